@@ -7,6 +7,129 @@
 #include "plugin.hpp"
 #include <array>
 
+using simd::float_4;
+
+/*
+    Sliding window detector for all 16 channels, stored as 4 groups of
+    4 channels so each group updates in one SIMD vector. The rectified
+    input is kept in a preallocated ring buffer of the window length.
+    Only RMS is vectorised, windowed peak walks one channel at a time
+*/
+struct WindowDetector
+{
+    // Ring buffer of rectified input, 4 float_4 groups per frame
+    std::vector<float_4> history;
+    // Monotonic deque of ring positions for each channel (windowed peak)
+    std::vector<int> deque;
+    std::array<int, 16> dequeHead = {};
+    std::array<int, 16> dequeSize = {};
+    // Running sum of squares over the window, and the sum since the
+    // ring last wrapped (RMS)
+    std::array<float_4, 4> sum = {};
+    std::array<float_4, 4> freshSum = {};
+    // Largest window we have room for, current window and write position
+    int capacity = 0;
+    int length = 1;
+    int pos = 0;
+
+    void resize(int frames)
+    {
+        // Only called outside of process(), so allocating here is fine
+        capacity = std::max(frames, 1);
+        history.assign(capacity * 4, float_4(0.f));
+        deque.assign(capacity * 16, 0);
+        reset(std::min(length, capacity));
+    }
+
+    void reset(int frames)
+    {
+        // Clear the window without reallocating
+        length = frames;
+        pos = 0;
+        std::fill(history.begin(), history.begin() + length * 4, float_4(0.f));
+        dequeHead = {};
+        dequeSize = {};
+        sum = {};
+        freshSum = {};
+    }
+
+    void processRms(std::array<float_4, 4> &in, int groups)
+    {
+        for (int g = 0; g < groups; g++)
+        {
+            /*
+                Swap the oldest sample out of the running sum for the
+                newest one, so the cost doesn't depend on window length
+            */
+            float_4 &old = history[pos * 4 + g];
+            float_4 sq = in[g] * in[g];
+            sum[g] += sq - old * old;
+            freshSum[g] += sq;
+            old = in[g];
+            in[g] = simd::sqrt(simd::fmax(sum[g], float_4(0.f)) / length);
+        }
+
+        // Once the ring wraps, everything in it was added to freshSum,
+        // so swap it in to drop any rounding error the running sum built up
+        if (++pos == length)
+        {
+            pos = 0;
+            sum = freshSum;
+            freshSum = {};
+        }
+    }
+
+    void processPeak(std::array<float_4, 4> &in, int channels)
+    {
+        // View the ring buffer as individual channel values
+        float *h = reinterpret_cast<float *>(history.data());
+
+        for (int c = 0; c < channels; c++)
+        {
+            int *dq = &deque[c * capacity];
+            int &head = dequeHead[c];
+            int &size = dequeSize[c];
+            float v = in[c / 4][c % 4];
+
+            // The front is the oldest sample, drop it if it's about to be overwritten
+            if (size > 0 && dq[head] == pos)
+            {
+                head = (head + 1 == length) ? 0 : head + 1;
+                size--;
+            }
+
+            /*
+                Drop anything from the back that is smaller than the new
+                sample, it can never be the peak again. Each sample is
+                pushed and popped once, so this is O(1) per sample on average
+            */
+            while (size > 0)
+            {
+                int back = head + size - 1;
+                if (back >= length)
+                    back -= length;
+                if (h[dq[back] * 16 + c] > v)
+                    break;
+                size--;
+            }
+
+            // Store the new sample and push it to the back
+            h[pos * 16 + c] = v;
+            int back = head + size;
+            if (back >= length)
+                back -= length;
+            dq[back] = pos;
+            size++;
+
+            // The front of the deque is the peak of the window
+            in[c / 4][c % 4] = h[dq[head] * 16 + c];
+        }
+
+        if (++pos == length)
+            pos = 0;
+    }
+};
+
 struct Kyle : Module
 {
     enum ParamId
@@ -31,6 +154,13 @@ struct Kyle : Module
     {
         LIGHTS_LEN
     };
+    enum DetectMode
+    {
+        DETECT_INSTANT,
+        DETECT_RMS,
+        DETECT_PEAK,
+        DETECT_LEN
+    };
 
     Kyle()
     {
@@ -41,19 +171,122 @@ struct Kyle : Module
         configInput(SIGNAL_INPUT, "Signal");
         configOutput(ENV_OUTPUT, "Envelope");
         configOutput(ENVINV_OUTPUT, "Inverse envelope");
+        // Preallocate for the default sample rate, updated on sample rate change
+        for (WindowDetector &detector : detectors)
+        {
+            detector.resize((int)std::ceil(windowTimes.back() * 48000.f));
+        }
     }
 
-    // Voltage of the current input signal
-    std::array<float, 16> currentVoltage = {};
+    // Window lengths (in seconds) for the RMS and windowed peak detectors
+    const std::vector<float> windowTimes = {0.001f, 0.005f, 0.01f, 0.025f, 0.05f};
+    // Crossover frequencies (in Hz) between bands, for each number of bands
+    const std::vector<std::vector<float>> crossoverFreqs = {
+        {},
+        {200.f},
+        {200.f, 2000.f},
+        {120.f, 600.f, 3000.f}};
+
+    // Detector mode, window length and number of bands, set from the context menu
+    int detectMode = DETECT_INSTANT;
+    int windowIndex = 2;
+    int bandIndex = 0;
+    // Settings the detectors and filters were last reset for
+    int appliedMode = DETECT_INSTANT;
+    int appliedChannels = 0;
+    int appliedBands = 0;
+    float appliedSampleRate = 0.f;
+    std::array<WindowDetector, 4> detectors;
+
+    /*
+        Linkwitz-Riley crossovers (two Butterworth biquads each) for
+        splitting the input into bands, one filter per group of 4 channels
+        [crossover][stage][group]
+    */
+    dsp::TBiquadFilter<float_4> lowpass[3][2][4];
+    dsp::TBiquadFilter<float_4> highpass[3][2][4];
+
+    // Signal of each band, [band][group]
+    std::array<std::array<float_4, 4>, 4> bandVoltage = {};
+    // Detected voltage of the current input signal
+    std::array<std::array<float_4, 4>, 4> currentVoltage = {};
     // Voltage of the output signal
-    std::array<float, 16> outVoltage = {};
+    std::array<std::array<float_4, 4>, 4> outVoltage = {};
     // Time since we hit the current input signal
-    std::array<float, 16> t = {};
+    std::array<std::array<float_4, 4>, 4> t = {};
     // Number of 0's sequentially from input
-    std::array<float, 16> n0 = {};
+    std::array<std::array<float_4, 4>, 4> n0 = {};
+    // Output envelope of every band, laid out band after band
+    std::array<float, 64> envVoltage = {};
     // Number of input and output channels
     int channels = 0;
 
+    void onSampleRateChange(const SampleRateChangeEvent &e) override
+    {
+        // Make room for the longest window at the new sample rate
+        for (WindowDetector &detector : detectors)
+        {
+            detector.resize((int)std::ceil(windowTimes.back() * e.sampleRate));
+        }
+    }
+
+    json_t *dataToJson() override
+    {
+        json_t *rootJ = json_object();
+        json_object_set_new(rootJ, "detectMode", json_integer(detectMode));
+        json_object_set_new(rootJ, "windowIndex", json_integer(windowIndex));
+        json_object_set_new(rootJ, "bandIndex", json_integer(bandIndex));
+        return rootJ;
+    }
+
+    void dataFromJson(json_t *rootJ) override
+    {
+        json_t *modeJ = json_object_get(rootJ, "detectMode");
+        if (modeJ)
+            detectMode = clamp((int)json_integer_value(modeJ), 0, DETECT_LEN - 1);
+        json_t *windowJ = json_object_get(rootJ, "windowIndex");
+        if (windowJ)
+            windowIndex = clamp((int)json_integer_value(windowJ), 0, (int)windowTimes.size() - 1);
+        json_t *bandJ = json_object_get(rootJ, "bandIndex");
+        if (bandJ)
+            bandIndex = clamp((int)json_integer_value(bandJ), 0, (int)crossoverFreqs.size() - 1);
+    }
+
+    void setCrossovers(int bands, float sRate)
+    {
+        // Set the cutoff of every crossover, and clear the filter state
+        for (int x = 0; x < bands - 1; x++)
+        {
+            float f = crossoverFreqs[bands - 1][x] / sRate;
+            for (int s = 0; s < 2; s++)
+            {
+                for (int g = 0; g < 4; g++)
+                {
+                    lowpass[x][s][g].reset();
+                    lowpass[x][s][g].setParameters(dsp::TBiquadFilter<float_4>::LOWPASS, f, M_SQRT1_2, 1.f);
+                    highpass[x][s][g].reset();
+                    highpass[x][s][g].setParameters(dsp::TBiquadFilter<float_4>::HIGHPASS, f, M_SQRT1_2, 1.f);
+                }
+            }
+        }
+    }
+
+    void splitBands(int bands, int group)
+    {
+        /*
+            Split off the lowest band at each crossover, and pass what's
+            above it on to the next crossover. The last band is whatever
+            is left above the highest crossover
+        */
+        float_4 rest = bandVoltage[0][group];
+        for (int x = 0; x < bands - 1; x++)
+        {
+            bandVoltage[x][group] = lowpass[x][1][group].process(lowpass[x][0][group].process(rest));
+            rest = highpass[x][1][group].process(highpass[x][0][group].process(rest));
+        }
+        bandVoltage[bands - 1][group] = rest;
+    }
+
     void setOutputs(float out, int channel)
     {
         // Assign direct and inverse outputs
@@ -61,22 +294,36 @@ struct Kyle : Module
         outputs[ENVINV_OUTPUT].setVoltage(10 - out, channel);
     }
 
-    void calcOutVoltage(float sRate, float sTime, int channel)
+    float_4 calcOutVoltage(float sRate, float sTime, int band, int group)
     {
         /*
             MODULE CALCULATIONS
+            Each group holds 4 channels, so the branches are done as masks
         */
 
+        float_4 in = currentVoltage[band][group];
+        float_4 &out = outVoltage[band][group];
+        float_4 &time = t[band][group];
+        float_4 &zeros = n0[band][group];
+
+        /*
+            Check if there is any input, and count the number of 0's.
+            After no signal for 1s we shut off, holding the current state
+        */
+        float_4 silent = in < 0.01f;
+        float_4 off = silent & (zeros > sRate);
+        zeros = simd::ifelse(silent, simd::ifelse(off, zeros, zeros + 1.f), float_4(0.f));
+
         // Add to the timer
-        t[channel] += sTime;
+        float_4 newT = time + sTime;
 
         /*
             We decay the signal either exponentially if PEXP != 0,
             otherwise we decay linearly
             out - (decay * e^(exp))
         */
-        outVoltage[channel] = outVoltage[channel] - ((params[PDECAY_PARAM].getValue() / sRate) *
-                                   exp((params[PEXP_PARAM].getValue() * t[channel])));;
+        float_4 newOut = out - ((params[PDECAY_PARAM].getValue() / sRate) *
+                                simd::exp(params[PEXP_PARAM].getValue() * newT));
 
         /*
             If the original signal is greater than our output voltage,
@@ -84,61 +331,114 @@ struct Kyle : Module
             Set the output to the signal voltage. Otherwise, use the
             decayed output voltage
         */
-        if (currentVoltage[channel] >= outVoltage[channel])
-        {
-            outVoltage[channel] = currentVoltage[channel];
-            // Reset the time
-            t[channel] = 0.f;
-        }
+        float_4 hit = in >= newOut;
+        newOut = simd::ifelse(hit, in, newOut);
+        // Reset the time
+        newT = simd::ifelse(hit, float_4(0.f), newT);
+
+        // Only update channels that haven't shut off
+        out = simd::ifelse(off, out, newOut);
+        time = simd::ifelse(off, time, newT);
 
         // Amplify the output (maxing out at 10)
-        float ampVoltage = std::min(10.f, abs(outVoltage[channel] * (1 + 9.f * params[PAMP_PARAM].getValue())));
+        float_4 ampVoltage = simd::fmin(float_4(10.f), simd::fabs(out * (1 + 9.f * params[PAMP_PARAM].getValue())));
 
-        // Set output voltages, accounting for amplification
-        setOutputs(ampVoltage, channel);
+        // Output voltage, accounting for amplification
+        return simd::ifelse(off, float_4(0.f), ampVoltage);
     }
 
     void process(const ProcessArgs &args) override
     {
         // POLYPHONY: Get the number of input channels
         channels = inputs[SIGNAL_INPUT].getChannels();
+        int groups = (channels + 3) / 4;
+        /*
+            POLYPHONY: Each band gets its own set of channels, up to 16.
+            If every band doesn't fit, fall back to a single full band
+        */
+        int bands = bandIndex + 1;
+        if (bands * channels > 16)
+        {
+            bands = 1;
+        }
 
-        /* INPUT */
-        // Get input voltage (keep it positive)
-        for (int c = 0; c < channels; c++)
+        // Reset the crossovers if the bands, channels or sample rate changed
+        if (bands != appliedBands || channels != appliedChannels || args.sampleRate != appliedSampleRate)
         {
-            currentVoltage[c] = abs(inputs[SIGNAL_INPUT].getPolyVoltage(c));
+            setCrossovers(bands, args.sampleRate);
+            appliedSampleRate = args.sampleRate;
+        }
 
-            /* OUTPUT */
+        // Reset the detectors if the mode, window, channels or bands changed
+        int length = clamp((int)(windowTimes[windowIndex] * args.sampleRate), 1, detectors[0].capacity);
+        if (detectMode != appliedMode || length != detectors[0].length ||
+            channels != appliedChannels || bands != appliedBands)
+        {
+            for (WindowDetector &detector : detectors)
+            {
+                detector.reset(length);
+            }
+            // Clear the envelopes if they were following a different band
+            if (bands != appliedBands)
+            {
+                outVoltage = {};
+                t = {};
+                n0 = {};
+            }
+            appliedMode = detectMode;
+            appliedChannels = channels;
+            appliedBands = bands;
+        }
 
-            // Check if there is any input
-            if (currentVoltage[c] < 0.01)
+        /* INPUT */
+        for (int g = 0; g < groups; g++)
+        {
+            bandVoltage[0][g] = inputs[SIGNAL_INPUT].getPolyVoltageSimd<float_4>(g * 4);
+            // Split the input into bands
+            if (bands > 1)
             {
-                // Check if we should shut off (after no signal for 1s)
-                if (n0[c] > args.sampleRate)
-                {
-                    setOutputs(0, c);
-                }
-                else
-                {
-                    // Iterate number of 0's
-                    n0[c] += 1;
+                splitBands(bands, g);
+            }
+            // Get each band's voltage (keep it positive)
+            for (int b = 0; b < bands; b++)
+            {
+                currentVoltage[b][g] = simd::fabs(bandVoltage[b][g]);
+            }
+        }
 
-                    // Calculate output
-                    calcOutVoltage(args.sampleRate, args.sampleTime, c);
-                }
+        for (int b = 0; b < bands; b++)
+        {
+            // Run the detector over the window, otherwise use the voltage as is
+            if (appliedMode == DETECT_RMS)
+            {
+                detectors[b].processRms(currentVoltage[b], groups);
             }
-            else
+            else if (appliedMode == DETECT_PEAK)
+            {
+                detectors[b].processPeak(currentVoltage[b], channels);
+            }
+
+            /*
+                Calculate the output for each group. Bands are laid out
+                one after another, so the spare lanes at the end of a band
+                get overwritten by the start of the next one
+            */
+            for (int g = 0; g < groups; g++)
             {
-                n0[c] = 0;
-                // Calculate output
-                calcOutVoltage(args.sampleRate, args.sampleTime, c);
-            }   
+                calcOutVoltage(args.sampleRate, args.sampleTime, b, g).store(&envVoltage[b * channels + g * 4]);
+            }
+        }
+
+        /* OUTPUT */
+        int outChannels = bands * channels;
+        for (int c = 0; c < outChannels; c++)
+        {
+            setOutputs(envVoltage[c], c);
         }
 
         // Finally set the number of output channels
-        outputs[ENV_OUTPUT].setChannels(channels);
-        outputs[ENVINV_OUTPUT].setChannels(channels);
+        outputs[ENV_OUTPUT].setChannels(outChannels);
+        outputs[ENVINV_OUTPUT].setChannels(outChannels);
     }
 };
 
@@ -168,6 +468,15 @@ struct KyleWidget : ModuleWidget {
 		addOutput(createOutputCentered<ThemedPJ301MPort>(mm2px(Vec(7.62, 90.0)), module, Kyle::ENV_OUTPUT));
 		addOutput(createOutputCentered<ThemedPJ301MPort>(mm2px(Vec(7.62, 105.5)), module, Kyle::ENVINV_OUTPUT));
 	}
+
+	void appendContextMenu(Menu* menu) override {
+		Kyle* module = getModule<Kyle>();
+
+		menu->addChild(new MenuSeparator);
+		menu->addChild(createIndexPtrSubmenuItem("Detector", {"Instantaneous", "RMS", "Windowed peak"}, &module->detectMode));
+		menu->addChild(createIndexPtrSubmenuItem("Window", {"1 ms", "5 ms", "10 ms", "25 ms", "50 ms"}, &module->windowIndex));
+		menu->addChild(createIndexPtrSubmenuItem("Bands", {"Off", "2 bands (up to 8 channels)", "3 bands (up to 5 channels)", "4 bands (up to 4 channels)"}, &module->bandIndex));
+	}
 };
 
 
@@ -46,6 +46,12 @@ struct Lola : Module
         configInput(IRECORD_INPUT, "Start/stop recording trigger");
         configInput(IPLAY_INPUT, "Start/restart playback trigger");
         configOutput(OUT_OUTPUT, "Output");
+
+        // Preallocate every take so recording never allocates
+        for (auto &take : takes)
+        {
+            take.resize(sampleMax + 1);
+        }
     }
 
     // Schmitt Triggers to check for rises
@@ -62,10 +68,81 @@ struct Lola : Module
     // Track if we are recording or playing audio
     bool isRecording = false;
     bool isPlaying = false;
-    // Vector to hold sample and index for reading
-    // Prepare for up to 16 values per sample
-    std::vector<std::array<float, 16>> sampleBuffer;
+    /*
+        Take buffers to hold samples, with up to 16 values per sample.
+        One take is played while the next one records into the spare,
+        then the two are swapped when recording is done
+    */
+    std::array<std::vector<std::array<float, 16>>, 2> takes;
+    std::array<int, 2> takeLength = {};
+    int playTake = 0;
+    int recTake = 1;
+    // Index for reading
     int i = 0;
+    // Crossfade from the old take (at its own read index) when swapping during playback
+    bool crossfade = true;
+    int fadeTake = 0;
+    int fadeTakeLength = 0;
+    int fadeIndex = 0;
+    int fadeLength = 1;
+    int fadeRemaining = 0;
+
+    json_t *dataToJson() override
+    {
+        json_t *rootJ = json_object();
+        json_object_set_new(rootJ, "crossfade", json_boolean(crossfade));
+        return rootJ;
+    }
+
+    void dataFromJson(json_t *rootJ) override
+    {
+        json_t *crossfadeJ = json_object_get(rootJ, "crossfade");
+        if (crossfadeJ)
+            crossfade = json_boolean_value(crossfadeJ);
+    }
+
+    void stopRecording(float sampleRate)
+    {
+        // Flip the recording flag
+        isRecording = false;
+        lights[LRECORD_LIGHT].setBrightness(0);
+
+        // If the old take is still playing, start the new take from the
+        // beginning and fade out of the old one from where it was
+        if (isPlaying)
+        {
+            if (crossfade)
+            {
+                fadeTake = playTake;
+                fadeTakeLength = takeLength[playTake];
+                fadeIndex = i;
+                // Fade over 10ms, fixed for the length of the fade
+                fadeLength = std::max(1, static_cast<int>(0.01f * sampleRate));
+                fadeRemaining = fadeLength;
+            }
+            i = 0;
+        }
+
+        // Swap the new take in for playback
+        std::swap(playTake, recTake);
+    }
+
+    float oldTakeVoltage(int c)
+    {
+        /*
+            The old take is now the spare, so a new recording may be
+            writing over it from frame 0. Both indexes move one frame
+            per sample, so the fade only reads overwritten frames if it
+            started at frame 0. Past its end or once overwritten, the old
+            take would have been passthrough
+        */
+        bool overwritten = isRecording && recTake == fadeTake && fadeIndex < takeLength[recTake];
+        if (fadeIndex < fadeTakeLength && !overwritten)
+        {
+            return takes[fadeTake][fadeIndex][c];
+        }
+        return inputs[SIGNAL_INPUT].getPolyVoltage(c);
+    }
 
     void process(const ProcessArgs &args) override
     {
@@ -86,19 +163,16 @@ struct Lola : Module
             // Start recording if we were not initially
             if (!isRecording)
             {
-                // Flip the recording and playing flag, empty the sample vector
-                isPlaying = false;
-                lights[LPLAY_LIGHT].setBrightness(0);
+                // Flip the recording flag and empty the spare take,
+                // the current take keeps playing
                 isRecording = true;
                 lights[LRECORD_LIGHT].setBrightness(1);
-                sampleBuffer.clear();
+                takeLength[recTake] = 0;
             }
             // Stop recording if we were
             else
             {
-                // Flip the recording flag
-                isRecording = false;
-                lights[LRECORD_LIGHT].setBrightness(0);
+                stopRecording(args.sampleRate);
             }
         }
 
@@ -110,23 +184,23 @@ struct Lola : Module
         // If we're recording, start storing the current signal as a sample
         if (isRecording)
         {
-            // Make sure the vector is below max size (4s of samples)
-            if (static_cast<int>(sampleBuffer.size()) > sampleMax)
+            // Make sure the take is below max size (4s of samples)
+            if (takeLength[recTake] > sampleMax)
             {
-                // If the vector is full, stop recording
-                isRecording = false;
-                lights[LRECORD_LIGHT].setBrightness(0);
+                // If the take is full, stop recording
+                stopRecording(args.sampleRate);
             }
             else
             {
-                // Push back the current input voltage into the vector
+                // Push back the current input voltage into the take
                 currentVoltage = {};
                 // Get all samples
                 for (int c = 0; c < channels; c++) 
                 {
                     currentVoltage[c] = inputs[SIGNAL_INPUT].getPolyVoltage(c);
                 }
-                sampleBuffer.push_back(currentVoltage);
+                takes[recTake][takeLength[recTake]] = currentVoltage;
+                takeLength[recTake]++;
             }
         }
 
@@ -142,16 +216,19 @@ struct Lola : Module
         if (params[BPLAY_PARAM].getValue() > oldBPlay ||
             playTrigger.process(inputs[IPLAY_INPUT].getVoltage()))
         {
-            // Start recording if the sample is not empty
-            if (!sampleBuffer.empty())
+            // Also stop recording, swapping in the new take
+            if (isRecording)
+            {
+                stopRecording(args.sampleRate);
+            }
+
+            // Start playing if the sample is not empty
+            if (takeLength[playTake] > 0)
             {
                 // Flip the flag and reset the iterator
                 isPlaying = true;
                 lights[LPLAY_LIGHT].setBrightness(1);
                 i = 0;
-                // Also stop recording
-                isRecording = false;
-                lights[LRECORD_LIGHT].setBrightness(0);
             }
         }
 
@@ -164,6 +241,7 @@ struct Lola : Module
             // Stop playback
             isPlaying = false;
             lights[LPLAY_LIGHT].setBrightness(0);
+            fadeRemaining = 0;
         }
 
         // Save the new stop button value, and set the signal accordingly
@@ -174,24 +252,43 @@ struct Lola : Module
         if (isPlaying)
         {
             // Make sure that we're not at the end of the sample
-            if (i == static_cast<int>(sampleBuffer.size()))
+            if (i >= takeLength[playTake])
             {
                 // If we are, stop playing
                 isPlaying = false;
                 lights[LPLAY_LIGHT].setBrightness(0);
+                fadeRemaining = 0;
                 // Send passthrough instead
                 outputs[OUT_OUTPUT].setVoltage(inputs[SIGNAL_INPUT].getVoltage());
             }
             // Play the sample
             else
             {
+                // If we just swapped takes, fade in from the old take
+                float oldGain = 0.f;
+                if (fadeRemaining > 0)
+                {
+                    oldGain = static_cast<float>(fadeRemaining) / fadeLength;
+                }
+
                 // Send current sample voltage to output, add to iterator
                 // Set to all channels to ensure 0 output
                 for (int c = 0; c < 16; c++)
                 {
-                    outputs[OUT_OUTPUT].setVoltage(sampleBuffer[i][c], c);
+                    float voltage = takes[playTake][i][c];
+                    if (oldGain > 0.f)
+                    {
+                        voltage = voltage * (1.f - oldGain) + oldTakeVoltage(c) * oldGain;
+                    }
+                    outputs[OUT_OUTPUT].setVoltage(voltage, c);
                 }
                 i++;
+
+                if (fadeRemaining > 0)
+                {
+                    fadeIndex++;
+                    fadeRemaining--;
+                }
             }
         }
         // Passthrough otherwise
@@ -240,6 +337,14 @@ struct LolaWidget : ModuleWidget
         addChild(createLightCentered<SmallLight<RedLight>>(mm2px(Vec(2.943, 60.258)), module, Lola::LPLAY_LIGHT));
         addChild(createLightCentered<SmallLight<RedLight>>(mm2px(Vec(2.943, 83.47)), module, Lola::LSTOP_LIGHT));
     }
+
+    void appendContextMenu(Menu *menu) override
+    {
+        Lola *module = getModule<Lola>();
+
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createBoolPtrMenuItem("Crossfade new takes", "", &module->crossfade));
+    }
 };
 
 Model *modelLola = createModel<Lola, LolaWidget>("Lola");
\ No newline at end of file